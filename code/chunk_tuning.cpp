@@ -0,0 +1,93 @@
+#include "chunk_tuning.hpp"
+
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <print>
+#include <string>
+
+namespace
+{
+std::optional<std::string> GetTuningDirectory()
+{
+    if (const char* cache_home = std::getenv("XDG_CACHE_HOME"); cache_home && *cache_home)
+    {
+        return std::string(cache_home) + "/obrc";
+    }
+
+    if (const char* home = std::getenv("HOME"); home && *home)
+    {
+        return std::string(home) + "/.cache/obrc";
+    }
+
+    return std::nullopt;
+}
+
+// Creates the directory together with all missing parents. Returns false if any of them could not be created.
+bool CreateDirectories(const std::string& path)
+{
+    for (size_t separator = path.find('/', 1); separator != std::string::npos;
+         separator = path.find('/', separator + 1))
+    {
+        if (mkdir(path.substr(0, separator).c_str(), 0755) == -1 && errno != EEXIST) return false;
+    }
+
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+std::optional<std::string> GetTuningFilePath()
+{
+    auto directory = GetTuningDirectory();
+    if (!directory) return std::nullopt;
+
+    char host_name[HOST_NAME_MAX + 1]{};
+    if (gethostname(host_name, sizeof(host_name)) == -1) return std::nullopt;
+
+    return *directory + "/" + host_name;
+}
+}  // namespace
+
+std::optional<double> LoadPersistedThroughput()
+{
+    const auto path = GetTuningFilePath();
+    if (!path) return std::nullopt;
+
+    FILE* file = std::fopen(path->c_str(), "r");
+    if (!file) return std::nullopt;
+
+    double bytes_per_ns = 0;
+    const bool parsed = std::fscanf(file, "%lf", &bytes_per_ns) == 1;
+    std::fclose(file);
+
+    // The file is writable by the user, it may contain anything
+    if (!parsed || !std::isfinite(bytes_per_ns) || bytes_per_ns <= 0) return std::nullopt;
+    return std::clamp(bytes_per_ns, kMinPersistedThroughput, kMaxPersistedThroughput);
+}
+
+void PersistThroughput(const double bytes_per_ns)
+{
+    const auto directory = GetTuningDirectory();
+    const auto path = GetTuningFilePath();
+    if (!directory || !path) return;
+
+    // Persisting is best effort: on failure nothing is written and the next run starts from defaults again
+    if (!CreateDirectories(*directory)) return;
+
+    // Write to a temporary file and rename it over the old one,
+    // so that concurrent or killed runs never leave a truncated value behind
+    const std::string temp_path = *path + "." + std::to_string(getpid()) + ".tmp";
+    FILE* file = std::fopen(temp_path.c_str(), "w");
+    if (!file) return;
+
+    std::println(file, "{}", bytes_per_ns);
+    if (std::fclose(file) != 0 || std::rename(temp_path.c_str(), path->c_str()) != 0)
+    {
+        std::remove(temp_path.c_str());
+    }
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <optional>
+
+// Parsing throughput of a single thread measured during previous runs on this host.
+// Stored in $XDG_CACHE_HOME/obrc/<hostname> (or ~/.cache/obrc/<hostname>).
+// Loaded values are clamped to [kMinPersistedThroughput, kMaxPersistedThroughput], non-finite ones are rejected.
+constexpr double kMinPersistedThroughput = 0.01;
+constexpr double kMaxPersistedThroughput = 100.0;
+
+std::optional<double> LoadPersistedThroughput();
+void PersistThroughput(double bytes_per_ns);
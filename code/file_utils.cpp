@@ -8,6 +8,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <bit>
 #include <cassert>
 #include <cstdio>
 
@@ -39,7 +40,7 @@ std::expected<MappedFile, MappedFileError> MappedFile::Open(const std::string_vi
 
     const auto num_bytes = static_cast<size_t>(sb.st_size);
     const char* raw_data =
-        reinterpret_cast<const char*>(mmap(NULL, num_bytes, PROT_WRITE, MAP_PRIVATE, fd, 0));  // NOLINT
+        reinterpret_cast<const char*>(mmap(NULL, num_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0));  // NOLINT
     if (!raw_data) return std::unexpected{MappedFileError::FailedToMmap};
 
     return MappedFile(fd, std::string_view(raw_data, num_bytes));
@@ -53,3 +54,14 @@ MappedFile::~MappedFile()
         assert(result != -1);
     }
 }
+
+bool PopulatePages(const std::string_view range)
+{
+    if (range.empty()) return true;
+
+    static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t begin = std::bit_cast<size_t>(range.data()) & ~(page_size - 1);
+    const size_t end = std::bit_cast<size_t>(range.data() + range.size());
+
+    return madvise(std::bit_cast<void*>(begin), end - begin, MADV_POPULATE_READ) == 0;
+}
@@ -32,3 +32,7 @@ private:
     std::string_view data_;
     int fd_ = -1;
 };
+
+// Maps pages of the range (reading them from disk if needed) with a single syscall,
+// so that subsequent reads of the range do not page fault. Returns false if the kernel refused to do that.
+bool PopulatePages(std::string_view range);
@@ -1,15 +1,26 @@
 #include <algorithm>
 #include <cassert>
+#include <cstdio>
 #include <ranges>
 #include <thread>
 #include <vector>
 
 #include "ankerl/unordered_dense.h"
 #include "bit_scan.h"
+#include "chunk_tuning.hpp"
 #include "file_utils.hpp"
 #include "measure_time.hpp"
+#include "pages_prefetcher.hpp"
 
 constexpr bool kWithDiagnosticInfo = false;
+
+// Big chunks are parsed in windows of this size, pages of the next window are prefetched meanwhile
+constexpr size_t kPrefetchWindowSize = 1 << 22;
+
+// Measured throughput is persisted only for files at least this big.
+// Small files are dominated by startup costs and would make the estimate too pessimistic.
+constexpr size_t kMinFileSizeToPersistThroughput = 1 << 26;
+
 constexpr std::optional<size_t> kOverrideThreadsCount = std::nullopt;
 // constexpr std::optional<size_t> kOverrideThreadsCount = 1;
 
@@ -45,6 +56,92 @@ public:
     int16_t max = std::numeric_limits<int16_t>::min();
 };
 
+using StationsMap = ankerl::unordered_dense::map<std::string_view, StationStats>;
+
+void ParseChunk(const std::string_view chunk, StationsMap& name_to_stats)
+{
+    auto pos = chunk.data();
+
+    const auto align_offset = std::bit_cast<size_t>(pos) % SymbolScanner::kAlignment;
+    const auto align_pos = pos - align_offset;
+    SymbolScanner semicolon_scanner(align_pos, align_offset, ';');
+    SymbolScanner line_br_scanner(align_pos, align_offset, '\n');
+
+    auto read_name = [&]() -> std::string_view
+    {
+        auto start = pos;
+        auto it = semicolon_scanner.GetNext();
+        assert(it > start);
+        assert(it != chunk.end());
+        pos = it + 1;
+        return std::string_view(start, it);
+    };
+
+    auto read_value = [&]() -> int16_t
+    {
+        const auto lb = line_br_scanner.GetNext();
+        assert(*lb == '\n');
+
+        const bool negative = *pos == '-';
+        pos = negative ? pos + 1 : pos;
+
+        const int value = ((lb[-1] - '0') + (lb[-3] - '0') * 10 + (lb[-4] - '0') * 100 * (lb - pos == 4)) *
+                          (negative ? -1 : 1);
+
+        pos = lb;
+        return static_cast<int16_t>(value);  // NOLINT
+    };
+
+    while (pos != chunk.end())
+    {
+        auto name = read_name();
+        StationStats& stats = name_to_stats[name];
+
+        const auto value = read_value();
+        assert(*pos == '\n');
+        ++pos;
+
+        stats.min = std::min(stats.min, value);
+        stats.max = std::max(stats.max, value);
+        stats.count++;
+        stats.sum += value;
+    }
+}
+
+// Big chunks are parsed in line-aligned windows. While one window is being parsed,
+// the prefetcher populates pages of the next one on its own thread.
+void ParseChunkPrefetching(
+    const std::string_view chunk,
+    StationsMap& name_to_stats,
+    PagesPrefetcher& prefetcher,
+    const size_t consumer_index)
+{
+    if (chunk.size() < kPrefetchWindowSize)
+    {
+        ParseChunk(chunk, name_to_stats);
+        return;
+    }
+
+    size_t window_begin = 0;
+    while (window_begin != chunk.size())
+    {
+        size_t window_end = chunk.size();
+        if (chunk.size() - window_begin > kPrefetchWindowSize)
+        {
+            window_end = chunk.find('\n', window_begin + kPrefetchWindowSize);
+            window_end = window_end == std::string_view::npos ? chunk.size() : window_end + 1;
+        }
+
+        if (window_end != chunk.size())
+        {
+            prefetcher.Post(consumer_index, chunk.data() + window_end);
+        }
+
+        ParseChunk(chunk.substr(window_begin, window_end - window_begin), name_to_stats);
+        window_begin = window_end;
+    }
+}
+
 void DeclareAffinity(size_t thread_index)
 {
     // Set thread affinity to bind to a specific core
@@ -55,65 +152,132 @@ void DeclareAffinity(size_t thread_index)
     assert(r == 0);
 }
 
+// Files smaller than this are parsed inline on the main thread without loading the persisted throughput,
+// spawning threads or declaring affinity: for them fixed startup costs dominate the parsing itself.
+// Covers the 100k-row file (~1.5 MiB), which measured no faster with threads; the 1mil-row one (~15 MiB) is threaded.
+constexpr size_t kInlineParsingMaxFileSize = 1 << 22;
+
+// Every thread should get at least this much work, otherwise spawning it and merging its results costs more
+// than it saves.
+constexpr double kMinThreadDurationNs = 500'000.0;
+
+size_t PlanThreadsCount(const size_t data_size, const double bytes_per_ns)
+{
+    const size_t hardware_threads = std::max(std::thread::hardware_concurrency(), 1U);
+    const auto min_bytes_per_thread = std::max(static_cast<size_t>(bytes_per_ns * kMinThreadDurationNs), 1UZ);
+    return std::clamp(data_size / min_bytes_per_thread, 1UZ, static_cast<size_t>(hardware_threads));
+}
+
 class DataSlicer
 {
 public:
-    explicit DataSlicer(const std::string_view data, const size_t consumers_count)
+    // Used when there is no persisted throughput for this host yet
+    static constexpr double kDefaultBytesPerNs = 1.0;
+
+    // Every chunk should take at least this long to parse, otherwise the overhead of taking it dominates
+    static constexpr double kMinChunkDurationNs = 200'000.0;
+
+    // Part of the remaining bytes a consumer takes proportionally to its share of the total throughput.
+    // Chunks shrink geometrically as the remaining work runs low, so all consumers finish at about the same time.
+    static constexpr double kRemainingBytesFraction = 0.75;
+
+    explicit DataSlicer(const std::string_view data, const size_t consumers_count, const double bytes_per_ns)
+        : data_(data),
+          consumers_(consumers_count),
+          min_chunk_size_(std::max(static_cast<size_t>(bytes_per_ns * kMinChunkDurationNs), 1UZ))
+    {
+        for (auto& consumer : consumers_)
+        {
+            consumer.bytes_per_ns.store(bytes_per_ns, std::memory_order_relaxed);
+        }
+    }
+
+    std::optional<std::string_view> GetChunk(const size_t consumer_index)
     {
-        // First part of the file will be processed in big chunks
-        size_t previous_end_pos = 0;
+        size_t begin = position_.load(std::memory_order_relaxed);
+        while (true)
         {
-            const size_t chunk_size = static_cast<size_t>(static_cast<double>(data.size()) * 0.9) / consumers_count;
-            for (size_t i = 0; i != consumers_count; ++i)
+            [[unlikely]] if (begin == data_.size())
             {
-                const size_t begin = previous_end_pos;
+                return std::nullopt;
+            }
 
-                size_t end = begin + chunk_size;
-                auto it = std::find(&data[end], &data.back(), '\n');
-                assert(it != data.end());
-                end = static_cast<size_t>(it - data.begin()) + 1;
+            const size_t bytes_remaining = data_.size() - begin;
+            const size_t chunk_size = ComputeChunkSize(consumer_index, bytes_remaining);
 
-                chunks_.push_back(std::string_view(data.data() + begin, data.data() + end));
-                previous_end_pos = end;
+            size_t end = data_.size();
+            if (chunk_size < bytes_remaining)
+            {
+                auto it = std::find(data_.begin() + static_cast<ptrdiff_t>(begin + chunk_size), data_.end(), '\n');
+                if (it != data_.end())
+                {
+                    end = static_cast<size_t>(it - data_.begin()) + 1;
+                }
+            }
+
+            if (position_.compare_exchange_weak(begin, end, std::memory_order_relaxed))
+            {
+                return std::string_view(data_.data() + begin, data_.data() + end);
             }
         }
+    }
 
-        constexpr size_t max_chunk_size = 1 << 21;
-        chunks_.reserve(((data.size() - previous_end_pos) / max_chunk_size) + 1);
-        while (previous_end_pos != data.size())
-        {
-            const size_t begin = previous_end_pos;
-            const size_t bytes_remaining = data.size() - begin;
-            const auto chunk_size = std::min(bytes_remaining, max_chunk_size);
+    void ReportThroughput(const size_t consumer_index, const size_t bytes, const std::chrono::nanoseconds duration)
+    {
+        if (duration.count() <= 0) return;
+        const double bytes_per_ns = static_cast<double>(bytes) / static_cast<double>(duration.count());
+        consumers_[consumer_index].bytes_per_ns.store(bytes_per_ns, std::memory_order_relaxed);
+        consumers_[consumer_index].reported.store(true, std::memory_order_relaxed);
+    }
 
-            size_t end = data.size();
-            if (begin + chunk_size < data.size())
+    // Average throughput of consumers that parsed at least one chunk.
+    // Others still hold the initial estimate and would pull the result back to it.
+    std::optional<double> MeasuredThroughput() const
+    {
+        double total = 0;
+        size_t reported_count = 0;
+        for (const auto& consumer : consumers_)
+        {
+            if (consumer.reported.load(std::memory_order_relaxed))
             {
-                end = begin + chunk_size;
-                auto it = std::find(&data[end], &data.back(), '\n');
-                assert(it != data.end());
-                end = static_cast<size_t>(it - data.begin()) + 1;
+                total += consumer.bytes_per_ns.load(std::memory_order_relaxed);
+                ++reported_count;
             }
-
-            chunks_.push_back(std::string_view(data.data() + begin, data.data() + end));
-            previous_end_pos = end;
         }
+
+        if (reported_count == 0) return std::nullopt;
+        return total / static_cast<double>(reported_count);
     }
 
-    std::optional<std::string_view> GetChunk()
+private:
+    double AverageThroughput() const
     {
-        auto i = index_.fetch_add(1);
-
-        [[unlikely]] if (i >= chunks_.size())
+        double total = 0;
+        for (const auto& consumer : consumers_)
         {
-            return std::nullopt;
+            total += consumer.bytes_per_ns.load(std::memory_order_relaxed);
         }
+        return total / static_cast<double>(consumers_.size());
+    }
 
-        return chunks_[i];
+    size_t ComputeChunkSize(const size_t consumer_index, const size_t bytes_remaining) const
+    {
+        const double own_throughput = consumers_[consumer_index].bytes_per_ns.load(std::memory_order_relaxed);
+        const double share = own_throughput / (AverageThroughput() * static_cast<double>(consumers_.size()));
+        const double chunk_size = static_cast<double>(bytes_remaining) * share * kRemainingBytesFraction;
+        return std::max(static_cast<size_t>(chunk_size), min_chunk_size_);
     }
 
-    std::vector<std::string_view> chunks_;
-    std::atomic<size_t> index_ = 0;
+    struct alignas(64) ConsumerState
+    {
+        std::atomic<double> bytes_per_ns = 0;
+        std::atomic<bool> reported = false;
+    };
+
+    std::string_view data_;
+    std::vector<ConsumerState> consumers_;
+    size_t min_chunk_size_ = 0;
+    std::atomic<size_t> position_ = 0;
 };
 
 struct ThreadMeaasurements
@@ -154,6 +318,8 @@ struct ThreadMeaasurements
 
 int main([[maybe_unused]] const int argc, char** argv)
 {
+    const auto main_start_time = ThreadMeaasurements::Now();
+
     if (argc < 2)
     {
         std::println("File path expected as program argument");
@@ -183,141 +349,153 @@ int main([[maybe_unused]] const int argc, char** argv)
     const std::string_view file_data = read_file_result.value().GetData();
     assert((reinterpret_cast<size_t>(file_data.data())) % 64 == 0);
 
-    const size_t threads_count = kOverrideThreadsCount.value_or(std::thread::hardware_concurrency());
-    DataSlicer slicer(file_data, threads_count);
-
     struct
     {
         std::mutex log_lock{};
         std::vector<ThreadMeaasurements> threads_measurements;
     } threads_shared_data{};
 
-    using StationsMap = ankerl::unordered_dense::map<std::string_view, StationStats>;
     using StationsIterator = StationsMap::iterator;
 
     StationsMap name_to_stats{};
-    std::vector<StationsMap> threads_stats;
-    const auto file_read_time = MeasureDuration(
-        [&]
+    std::chrono::milliseconds file_read_time{};
+    std::optional<double> throughput_to_persist;
+
+    if (!kOverrideThreadsCount && file_data.size() < kInlineParsingMaxFileSize)
+    {
+        file_read_time = MeasureDuration(
+            [&]
+            {
+                name_to_stats = StationsMap(1400);
+                ParseChunk(file_data, name_to_stats);
+            });
+    }
+    else
+    {
+        const std::optional<double> persisted_bytes_per_ns = LoadPersistedThroughput();
+        const double bytes_per_ns = persisted_bytes_per_ns.value_or(DataSlicer::kDefaultBytesPerNs);
+        const size_t threads_count = kOverrideThreadsCount.value_or(PlanThreadsCount(file_data.size(), bytes_per_ns));
+        DataSlicer slicer(file_data, threads_count, bytes_per_ns);
+        PagesPrefetcher prefetcher(file_data, threads_count, kPrefetchWindowSize);
+
+        // Workers merge their maps pairwise as soon as they run out of chunks: a worker either parks its map here
+        // or takes the parked one and merges it into its own outside of the lock. This way merging overlaps
+        // with parsing done by the threads that are still busy and workers finishing together merge in parallel.
+        // Once all workers are done the only parked map holds everything.
+        struct
         {
-            threads_stats.resize(threads_count);
-            if constexpr (kWithDiagnosticInfo)
+            std::mutex lock{};
+            std::optional<StationsMap> parked{};
+        } merged_stats{};
+
+        file_read_time = MeasureDuration(
+            [&]
             {
-                threads_shared_data.threads_measurements.resize(threads_count);
-            }
+                if constexpr (kWithDiagnosticInfo)
+                {
+                    threads_shared_data.threads_measurements.resize(threads_count);
+                }
 
-            std::vector<std::jthread> threads;
-            threads.reserve(threads_count);
+                std::vector<std::jthread> threads;
+                threads.reserve(threads_count);
 
-            for (size_t thread_index : std::views::iota(0UZ, threads_count))
-            {
-                const auto thread_fn = [&threads_shared_data, &threads_stats, thread_index, &slicer]()
+                for (size_t thread_index : std::views::iota(0UZ, threads_count))
                 {
-                    [[maybe_unused]] const auto& tm = threads_shared_data;  // unused var warning...
-                    if constexpr (kWithDiagnosticInfo)
+                    const auto thread_fn =
+                        [&threads_shared_data, &merged_stats, &slicer, &prefetcher, thread_index, threads_count]()
                     {
-                        threads_shared_data.threads_measurements[thread_index].RecordStartTime();
-                    }
+                        [[maybe_unused]] const auto& tm = threads_shared_data;  // unused var warning...
 
-                    StationsMap name_to_stats(1400);
-                    while (const auto opt_chunk = slicer.GetChunk())
-                    {
-                        const auto& chunk = opt_chunk.value();
+                        // Pinning a single thread buys nothing and costs a syscall
+                        if (threads_count > 1)
+                        {
+                            DeclareAffinity(thread_index);
+                        }
 
                         if constexpr (kWithDiagnosticInfo)
                         {
-                            std::scoped_lock sl{threads_shared_data.log_lock};
-                            std::println(
-                                "Thread {} took chunk [{:#x}; {:#x}). {} bytes",
-                                thread_index,
-                                std::bit_cast<size_t>(chunk.begin()),
-                                std::bit_cast<size_t>(chunk.end()),
-                                chunk.size());
+                            threads_shared_data.threads_measurements[thread_index].RecordStartTime();
                         }
 
-                        DeclareAffinity(thread_index);
-                        auto pos = chunk.data();
-
-                        const auto align_offset = std::bit_cast<size_t>(pos) % SymbolScanner::kAlignment;
-                        const auto align_pos = pos - align_offset;
-                        SymbolScanner semicolon_scanner(align_pos, align_offset, ';');
-                        SymbolScanner line_br_scanner(align_pos, align_offset, '\n');
-
-                        auto read_name = [&]() -> std::string_view
+                        StationsMap name_to_stats(1400);
+                        size_t bytes_parsed = 0;
+                        std::chrono::nanoseconds parsing_duration{};
+                        while (const auto opt_chunk = slicer.GetChunk(thread_index))
                         {
-                            auto start = pos;
-                            auto it = semicolon_scanner.GetNext();
-                            assert(it > start);
-                            assert(it != chunk.end());
-                            pos = it + 1;
-                            return std::string_view(start, it);
-                        };
-
-                        auto read_value = [&]() -> int16_t
-                        {
-                            const auto lb = line_br_scanner.GetNext();
-                            assert(*lb == '\n');
-
-                            const bool negative = *pos == '-';
-                            pos = negative ? pos + 1 : pos;
-
-                            const int value =
-                                ((lb[-1] - '0') + (lb[-3] - '0') * 10 + (lb[-4] - '0') * 100 * (lb - pos == 4)) *
-                                (negative ? -1 : 1);
-
-                            pos = lb;
-                            return static_cast<int16_t>(value);  // NOLINT
-                        };
+                            const auto& chunk = opt_chunk.value();
+                            const auto chunk_start_time = ThreadMeaasurements::Now();
+
+                            if constexpr (kWithDiagnosticInfo)
+                            {
+                                std::scoped_lock sl{threads_shared_data.log_lock};
+                                std::println(
+                                    "Thread {} took chunk [{:#x}; {:#x}). {} bytes",
+                                    thread_index,
+                                    std::bit_cast<size_t>(chunk.begin()),
+                                    std::bit_cast<size_t>(chunk.end()),
+                                    chunk.size());
+                            }
+
+                            ParseChunkPrefetching(chunk, name_to_stats, prefetcher, thread_index);
+
+                            bytes_parsed += chunk.size();
+                            parsing_duration += ThreadMeaasurements::Now() - chunk_start_time;
+                            slicer.ReportThroughput(thread_index, bytes_parsed, parsing_duration);
+                        }
 
-                        while (pos != chunk.end())
+                        while (true)
                         {
-                            auto name = read_name();
-                            StationStats& stats = name_to_stats[name];
-
-                            const auto value = read_value();
-                            assert(*pos == '\n');
-                            ++pos;
+                            StationsMap other;
+                            {
+                                std::scoped_lock sl{merged_stats.lock};
+                                if (!merged_stats.parked)
+                                {
+                                    merged_stats.parked = std::move(name_to_stats);
+                                    break;
+                                }
+
+                                other = std::move(*merged_stats.parked);
+                                merged_stats.parked.reset();
+                            }
+
+                            if (other.size() > name_to_stats.size()) std::swap(other, name_to_stats);
+                            for (const auto& [name, stats] : other)
+                            {
+                                name_to_stats[name].MergeFrom(stats);
+                            }
+                        }
 
-                            stats.min = std::min(stats.min, value);
-                            stats.max = std::max(stats.max, value);
-                            stats.count++;
-                            stats.sum += value;
+                        if constexpr (kWithDiagnosticInfo)
+                        {
+                            threads_shared_data.threads_measurements[thread_index].RecordEndTime();
                         }
+                    };
+
+                    // No need to spawn a new thread for the last chunk - going to wait for all of them anyway
+                    // so this thread can be reused
+                    if (thread_index == threads_count - 1)
+                    {
+                        thread_fn();
                     }
-                    threads_stats[thread_index] = std::move(name_to_stats);
-                    if constexpr (kWithDiagnosticInfo)
+                    else
                     {
-                        threads_shared_data.threads_measurements[thread_index].RecordEndTime();
+                        threads.emplace_back(std::move(thread_fn));
                     }
-                };
-
-                // No need to spawn a new thread for the last chunk - going to wait for all of them anyway
-                // so this thread can be reused
-                if (thread_index == threads_count - 1)
-                {
-                    thread_fn();
                 }
-                else
-                {
-                    threads.emplace_back(std::move(thread_fn));
-                }
-            }
-        });
+            });
 
-    const auto merge_duration = MeasureDuration(
-        [&]
-        {
-            // Merge data
-            name_to_stats = std::move(threads_stats.front());
+        // All workers are joined at this point
+        assert(merged_stats.parked);
+        name_to_stats = std::move(*merged_stats.parked);
 
-            for (auto& thread_stats : threads_stats | std::views::drop(1))
-            {
-                for (const auto& [name, stats] : thread_stats)
-                {
-                    name_to_stats[name].MergeFrom(stats);
-                }
-            }
-        });
+        // Written only after the result is printed, to keep file system calls off the critical path
+        const auto measured_bytes_per_ns = slicer.MeasuredThroughput();
+        if (file_data.size() >= kMinFileSizeToPersistThroughput && measured_bytes_per_ns)
+        {
+            throughput_to_persist = persisted_bytes_per_ns ? (*persisted_bytes_per_ns + *measured_bytes_per_ns) / 2
+                                                           : *measured_bytes_per_ns;
+        }
+    }
 
     // Print merged data
     std::vector<StationsIterator> sorted_stats;
@@ -352,49 +530,59 @@ int main([[maybe_unused]] const int argc, char** argv)
             std::println("}}");
         });
 
+    if (throughput_to_persist)
+    {
+        std::fflush(stdout);
+        PersistThroughput(*throughput_to_persist);
+    }
+
     if constexpr (kWithDiagnosticInfo)
     {
         using namespace std::literals;
         const auto max_string =
             std::ranges::max_element(std::views::keys(name_to_stats), std::less<>{}, &std::string_view::size);
 
-        std::println("File read time: {}", file_read_time);
-        std::println("Merge time: {}", merge_duration);
+        std::println("File read and merge time: {}", file_read_time);
         std::println("Sorting time: {}", sorting_duration);
         std::println("Printing duration: {}", printing_duration);
+        std::println(
+            "Total time: {}",
+            std::chrono::duration_cast<std::chrono::microseconds>(ThreadMeaasurements::Now() - main_start_time));
         std::println("Max string: {}", *max_string);
         std::println("Max string length: {}", (*max_string).size());
 
-        std::println("Threads durations: ");
-        for (size_t thread_index = 0; thread_index != threads_shared_data.threads_measurements.size(); ++thread_index)
+        // Empty when the file was parsed inline
+        if (!threads_shared_data.threads_measurements.empty())
         {
+            std::println("Threads durations: ");
+            const auto& threads_measurements = threads_shared_data.threads_measurements;
+            for (size_t thread_index = 0; thread_index != threads_measurements.size(); ++thread_index)
+            {
+                std::println("   {}: {}", thread_index, threads_measurements[thread_index].DurationMs());
+            }
             std::println(
-                "   {}: {}",
-                thread_index,
-                threads_shared_data.threads_measurements[thread_index].DurationMs());
-        }
-        std::println(
-            "   min: {}",
-            (*std::ranges::min_element(
-                 threads_shared_data.threads_measurements,
-                 std::less<>{},
-                 &ThreadMeaasurements::DurationMs))
-                .DurationMs());
+                "   min: {}",
+                (*std::ranges::min_element(
+                     threads_shared_data.threads_measurements,
+                     std::less<>{},
+                     &ThreadMeaasurements::DurationMs))
+                    .DurationMs());
 
-        std::println(
-            "   avg: {}",
-            std::ranges::fold_left(
-                std::views::transform(threads_shared_data.threads_measurements, &ThreadMeaasurements::DurationDbl),
-                0.0,
-                std::plus<>{}) /
-                static_cast<double>(threads_shared_data.threads_measurements.size()));
-        std::println(
-            "   max: {}",
-            (*std::ranges::max_element(
-                 threads_shared_data.threads_measurements,
-                 std::less<>{},
-                 &ThreadMeaasurements::DurationMs))
-                .DurationMs());
+            std::println(
+                "   avg: {}",
+                std::ranges::fold_left(
+                    std::views::transform(threads_shared_data.threads_measurements, &ThreadMeaasurements::DurationDbl),
+                    0.0,
+                    std::plus<>{}) /
+                    static_cast<double>(threads_shared_data.threads_measurements.size()));
+            std::println(
+                "   max: {}",
+                (*std::ranges::max_element(
+                     threads_shared_data.threads_measurements,
+                     std::less<>{},
+                     &ThreadMeaasurements::DurationMs))
+                    .DurationMs());
+        }
     }
 
     return 0;
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "file_utils.hpp"
+
+// Populates pages of the file on a helper thread while parsing threads work on the data before them.
+// A parser posts the beginning of its next window and carries on - it never waits for the prefetcher.
+// If the prefetcher is late the parser just faults the pages in itself.
+class PagesPrefetcher
+{
+public:
+    explicit PagesPrefetcher(const std::string_view data, const size_t consumers_count, const size_t window_size)
+        : data_(data),
+          window_size_(window_size),
+          requests_(consumers_count),
+          thread_(
+              [this](const std::stop_token& stop_token)
+              {
+                  Run(stop_token);
+              })
+    {
+    }
+
+    PagesPrefetcher(const PagesPrefetcher&) = delete;
+    PagesPrefetcher& operator=(const PagesPrefetcher&) = delete;
+
+    ~PagesPrefetcher()
+    {
+        thread_.request_stop();
+        Wake();
+    }
+
+    void Post(const size_t consumer_index, const char* window_begin)
+    {
+        requests_[consumer_index].window_begin.store(window_begin, std::memory_order_relaxed);
+        Wake();
+    }
+
+private:
+    void Wake()
+    {
+        generation_.fetch_add(1, std::memory_order_release);
+        generation_.notify_one();
+    }
+
+    void Run(const std::stop_token& stop_token)
+    {
+        while (!stop_token.stop_requested())
+        {
+            const size_t generation = generation_.load(std::memory_order_acquire);
+            for (auto& request : requests_)
+            {
+                if (const char* window_begin = request.window_begin.exchange(nullptr, std::memory_order_relaxed))
+                {
+                    const auto window_size = std::min(window_size_, static_cast<size_t>(data_.end() - window_begin));
+                    [[maybe_unused]] const bool populated = PopulatePages(std::string_view(window_begin, window_size));
+                    assert(populated);
+                }
+            }
+
+            generation_.wait(generation, std::memory_order_acquire);
+        }
+    }
+
+    struct alignas(64) Request
+    {
+        std::atomic<const char*> window_begin = nullptr;
+    };
+
+    std::string_view data_;
+    size_t window_size_ = 0;
+    std::vector<Request> requests_;
+    std::atomic<size_t> generation_ = 0;
+    std::jthread thread_;
+};
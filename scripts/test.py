@@ -1,4 +1,6 @@
 from pathlib import Path
+import argparse
+import shutil
 import subprocess
 import time
 from typing import Tuple
@@ -86,7 +88,7 @@ def create_files_for_testing(num_lines: int, suffix: str) -> Tuple[Path, Path]:
     return measurements_file_path, expected_result_file_path
 
 
-def run_and_compare():
+def run_and_compare() -> bool:
     lines_and_suffixes = [
         (10000, "10k"),
         (100000, "100k"),
@@ -135,9 +137,39 @@ def run_and_compare():
         print(f"Min time: {min(durations)}")
         print(f"Max time: {max(durations)}")
 
+    return all_results_correct
+
+
+def benchmark_small_inputs_latency(baseline_program_path: Path | None):
+    # Timing from Python adds about a millisecond of fork/exec overhead which hides the difference,
+    # so hyperfine runs the program directly and a no-op command shows the process startup cost.
+    if shutil.which("hyperfine") is None:
+        print("hyperfine is not installed. Skipping latency benchmark")
+        return
+
+    programs = [PROGRAM_PATH] if baseline_program_path is None else [baseline_program_path, PROGRAM_PATH]
+
+    commands = ["true"]
+    for num_lines, suffix in [(10000, "10k"), (100000, "100k"), (1000000, "1mil")]:
+        measurements_file_path, _ = create_files_for_testing(num_lines, suffix)
+        for program_path in programs:
+            commands.append(f"{program_path.as_posix()} {measurements_file_path.as_posix()}")
+
+    subprocess.run(
+        check=True,
+        args=["hyperfine", "--shell=none", "--warmup", "20", "--runs", "200", "--output=null", *commands],
+    )
+
 
 def main():
-    run_and_compare()
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--latency", action="store_true", help="benchmark latency on small inputs after the tests")
+    parser.add_argument("--baseline-program", type=Path, help="another obrc build to compare latency with")
+    args = parser.parse_args()
+
+    all_results_correct = run_and_compare()
+    if all_results_correct and args.latency:
+        benchmark_small_inputs_latency(args.baseline_program)
 
 
 if __name__ == "__main__":